@@ -3,9 +3,21 @@
 #include "petscmat.h"
 #include "petscmath.h"
 #include "mfem.hpp"
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
 #include <fstream>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace mfem;
@@ -13,45 +25,486 @@ using namespace mfem;
 static  char help[]=
 "This example demonstrates use of the TAO package to \n\
 solve an obstacle problem defined using MFEM. Discretization \n\
-is based on serial ex1.cpp from MFEM examples.\n";
-
-// Define a ring-shaped obstacle function centered at the origin with radius 0.4
-double RingObstacle(const Vector &x) 
-{
-  double t = 0.05;
-  double r = pow(x(0), 2) + pow(x(1), 2);
-  double rad = 0.4;
-  double ul = pow(rad, 2);
-  double ll = pow(rad-t, 2);
-  if ((ll <= r) && (r <= ul)) {
-    return 1.0;
-  } else {
-    return PETSC_NINFINITY;
+is based on parallel ex1p.cpp from MFEM examples.\n";
+
+// Parametrized obstacle centered at the origin. 'shape' indexes the table
+// returned by ObstacleShapes().
+struct ObstacleParams {
+  int shape;
+  double size;       // outer radius of the ring, half side of the square
+  double thickness;
+  double height;
+};
+
+// An obstacle kernel evaluates the obstacle at the n points (x[i], y[i]) and
+// writes the lower bounds to lb[i]. Points off the obstacle get "negative
+// infinity" (PETSC_NINFINITY), leaving those dofs unbounded below. Kernels
+// run over contiguous coordinate arrays and should be written without
+// branches, so that the compiler can vectorize them across SIMD lanes.
+typedef void (*ObstacleKernel)(const ObstacleParams &p, int n, const double *x,
+                               const double *y, double *lb);
+
+// Ring-shaped obstacle with outer radius p.size; a thickness of at least
+// p.size gives a filled disk
+void RingObstacle(const ObstacleParams &p, int n, const double *x,
+                  const double *y, double *lb)
+{
+  const double inner = std::max(p.size - p.thickness, 0.0);
+  const double ul = p.size*p.size;
+  const double ll = inner*inner;
+  const double h = p.height, ninf = PETSC_NINFINITY;
+  for (int i = 0; i < n; i++) {
+    double r = x[i]*x[i] + y[i]*y[i];
+    bool on = (ll <= r) & (r <= ul);
+    lb[i] = on ? h : ninf;
   }
 }
 
-// Define a square shaped obstacle function centered at the origin with side length 0.8
-double SquareObstacle(const Vector &x)
+// Square shaped obstacle with side length 2*p.size: a point is on the
+// obstacle if its max-norm distance from the origin is in [size-t, size]
+void SquareObstacle(const ObstacleParams &p, int n, const double *x,
+                    const double *y, double *lb)
 {
-  double t = 0.05;
-  double lim = 0.4;
-  if (((x(0) <= lim) && (x(0) >= lim-t) && (x(1) <= lim) && (x(1) >= -lim)) ||
-      ((x(0) >= -lim) && (x(0) <= -lim+t) && (x(1) <= lim) && (x(1) >= -lim)) ||
-      ((x(1) <= lim) && (x(1) >= lim-t) && (x(0) <= lim) && (x(0) >= -lim)) ||
-      ((x(1) >= -lim) && (x(1) <= -lim+t) && (x(0) <= lim) && (x(0) >= -lim))) {
-    return 1.0;
-  } else {
-    return PETSC_NINFINITY;
+  const double lim = p.size, inner = p.size - p.thickness;
+  const double h = p.height, ninf = PETSC_NINFINITY;
+  for (int i = 0; i < n; i++) {
+    double ax = fabs(x[i]), ay = fabs(y[i]);
+    double m = (ax > ay) ? ax : ay;
+    bool on = (inner <= m) & (m <= lim);
+    lb[i] = on ? h : ninf;
   }
 }
 
+// Table of the known obstacle shapes
+struct ObstacleShape {
+  string name;
+  ObstacleKernel kernel;
+};
+
+// Built-in shapes, indexing the ObstacleShapes() table
+enum { OBS_RING = 0, OBS_SQUARE = 1, OBS_NUM_BUILTIN };
+
+std::vector<ObstacleShape> &ObstacleShapes()
+{
+   static std::vector<ObstacleShape> shapes;
+   if (shapes.empty())
+   {
+      ObstacleShape ring = { "ring", RingObstacle };
+      ObstacleShape square = { "square", SquareObstacle };
+      shapes.resize(OBS_NUM_BUILTIN);
+      shapes[OBS_RING] = ring;
+      shapes[OBS_SQUARE] = square;
+   }
+   return shapes;
+}
+
+// Register a user-defined obstacle shape under 'name', making it available
+// in batch files. Returns the value to use for ObstacleParams::shape.
+int AddObstacleShape(const string &name, ObstacleKernel kernel)
+{
+   ObstacleShape shape = { name, kernel };
+   ObstacleShapes().push_back(shape);
+   return (int)ObstacleShapes().size() - 1;
+}
+
+// Read obstacles from a batch file with one "<shape> size thickness [height]"
+// entry per line, where <shape> is the name of a registered shape (ring,
+// square, ...). Size and thickness must be positive. Empty lines and lines
+// starting with '#' are skipped.
+void ReadObstacles(const char *fname, std::vector<ObstacleParams> &obstacles)
+{
+   ifstream in(fname);
+   MFEM_VERIFY(in, "cannot open batch file " << fname);
+   string line;
+   while (getline(in, line))
+   {
+      istringstream ls(line);
+      string shape;
+      if (!(ls >> shape) || shape[0] == '#') { continue; }
+      ObstacleParams p;
+      p.height = 1.0;
+      ls >> p.size >> p.thickness;
+      MFEM_VERIFY(ls && p.size > 0.0 && p.thickness > 0.0,
+                  "invalid batch file entry: " << line);
+      double h;
+      if (ls >> h) { p.height = h; }
+      p.shape = -1;
+      for (size_t k = 0; k < ObstacleShapes().size(); k++)
+      {
+         if (ObstacleShapes()[k].name == shape) { p.shape = (int)k; }
+      }
+      MFEM_VERIFY(p.shape >= 0, "unknown obstacle shape: " << shape);
+      obstacles.push_back(p);
+   }
+}
+
+// Thread-safe FIFO with a fixed capacity. Push() blocks while the queue is
+// full, so a fast producer can never hold more than 'capacity' items in memory.
+template <typename T>
+class BoundedQueue
+{
+private:
+   std::deque<T> items;
+   size_t capacity;
+   bool closed;
+   std::mutex mtx;
+   std::condition_variable not_full, not_empty;
+
+public:
+   BoundedQueue(size_t cap) : capacity(cap > 0 ? cap : 1), closed(false) { }
+
+   void Push(T &&item)
+   {
+      std::unique_lock<std::mutex> lock(mtx);
+      not_full.wait(lock, [this] { return items.size() < capacity; });
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+   }
+
+   // Returns false once the queue has been closed and drained.
+   bool Pop(T &item)
+   {
+      std::unique_lock<std::mutex> lock(mtx);
+      not_empty.wait(lock, [this] { return closed || !items.empty(); });
+      if (items.empty()) { return false; }
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+   }
+
+   void Close()
+   {
+      std::lock_guard<std::mutex> lock(mtx);
+      closed = true;
+      not_empty.notify_all();
+   }
+};
+
+// Encodings for the iterate history file:
+//  - HIST_RAW stores every frame as plain doubles,
+//  - HIST_DELTA XORs each frame with the previous one and run-length encodes
+//    the unchanged (zero) words,
+//  - HIST_COMPRESSED additionally strips the leading zero bytes of every
+//    changed word. Both delta encodings are lossless.
+enum { HIST_RAW = 0, HIST_DELTA = 1, HIST_COMPRESSED = 2 };
+
+static const char hist_magic[8] = {'O','B','S','H','I','S','T','1'};
+
+// One stored iterate of the optimization
+struct HistoryFrame {
+  int iteration;
+  std::vector<double> data;
+};
+
+// Shared XOR-delta state for the history encoder and decoder
+class HistoryCodec
+{
+protected:
+   int encoding;
+   std::vector<uint64_t> prev; // bit patterns of the last frame
+   std::vector<char> payload;
+
+   HistoryCodec(int enc, int size) : encoding(enc), prev(size, 0) { }
+
+   // Upper bound on the encoded size of one frame
+   size_t MaxPayload() const;
+   void Encode(const std::vector<double> &data);
+   void Decode(std::vector<double> &data);
+};
+
+size_t HistoryCodec::MaxPayload() const
+{
+   const size_t n = prev.size();
+   switch (encoding)
+   {
+      case HIST_RAW: return n*sizeof(double);
+      // worst case alternates zero and changed words: one record per two words
+      case HIST_DELTA: return n*sizeof(uint64_t) + (n/2 + 1)*2*sizeof(uint32_t);
+      // one control byte per changed word
+      default: return n*(sizeof(uint64_t) + 1);
+   }
+}
+
+void HistoryCodec::Encode(const std::vector<double> &data)
+{
+   const size_t n = prev.size();
+   payload.clear();
+   if (encoding == HIST_RAW)
+   {
+      payload.resize(n*sizeof(double));
+      memcpy(payload.data(), data.data(), payload.size());
+      return;
+   }
+
+   std::vector<uint64_t> delta(n);
+   for (size_t i = 0; i < n; i++)
+   {
+      uint64_t bits;
+      memcpy(&bits, &data[i], sizeof(bits));
+      delta[i] = bits ^ prev[i];
+      prev[i] = bits;
+   }
+
+   if (encoding == HIST_DELTA)
+   {
+      // sequence of (zero run, literal count, literals)
+      size_t i = 0;
+      while (i < n)
+      {
+         uint32_t zeros = 0, lits = 0;
+         while (i + zeros < n && delta[i + zeros] == 0) { zeros++; }
+         i += zeros;
+         while (i + lits < n && delta[i + lits] != 0) { lits++; }
+         size_t off = payload.size();
+         payload.resize(off + 2*sizeof(uint32_t) + lits*sizeof(uint64_t));
+         // the last run usually has no literals, so 'i' may be n here
+         char *rec = payload.data() + off;
+         memcpy(rec, &zeros, sizeof(uint32_t));
+         memcpy(rec + sizeof(uint32_t), &lits, sizeof(uint32_t));
+         memcpy(rec + 2*sizeof(uint32_t), delta.data() + i,
+                lits*sizeof(uint64_t));
+         i += lits;
+      }
+      return;
+   }
+
+   // HIST_COMPRESSED: control byte 0x80|(run-1) for up to 128 zero words,
+   // otherwise the number of significant low-order bytes that follow.
+   size_t i = 0;
+   while (i < n)
+   {
+      if (delta[i] == 0)
+      {
+         int run = 0;
+         while (i < n && delta[i] == 0 && run < 128) { run++; i++; }
+         payload.push_back((char)(0x80 | (run - 1)));
+         continue;
+      }
+      uint64_t w = delta[i++];
+      int nbytes = 8;
+      while ((w >> (8*(nbytes - 1))) == 0) { nbytes--; }
+      payload.push_back((char)nbytes);
+      for (int b = 0; b < nbytes; b++)
+      {
+         payload.push_back((char)((w >> (8*b)) & 0xff));
+      }
+   }
+}
+
+void HistoryCodec::Decode(std::vector<double> &data)
+{
+   const size_t n = prev.size();
+   data.resize(n);
+   if (encoding == HIST_RAW)
+   {
+      MFEM_VERIFY(payload.size() == n*sizeof(double), "corrupt history frame");
+      memcpy(data.data(), payload.data(), payload.size());
+      return;
+   }
+
+   size_t i = 0, p = 0;
+   if (encoding == HIST_DELTA)
+   {
+      while (i < n)
+      {
+         uint32_t zeros, lits;
+         MFEM_VERIFY(p + 2*sizeof(uint32_t) <= payload.size(),
+                     "corrupt history frame");
+         memcpy(&zeros, &payload[p], sizeof(uint32_t));
+         memcpy(&lits, &payload[p + sizeof(uint32_t)], sizeof(uint32_t));
+         p += 2*sizeof(uint32_t);
+         MFEM_VERIFY(zeros + lits > 0 && i + zeros + lits <= n &&
+                     p + lits*sizeof(uint64_t) <= payload.size(),
+                     "corrupt history frame");
+         i += zeros;
+         for (uint32_t k = 0; k < lits; k++, i++, p += sizeof(uint64_t))
+         {
+            uint64_t w;
+            memcpy(&w, &payload[p], sizeof(w));
+            prev[i] ^= w;
+         }
+      }
+   }
+   else
+   {
+      while (i < n)
+      {
+         MFEM_VERIFY(p < payload.size(), "corrupt history frame");
+         unsigned char c = (unsigned char)payload[p++];
+         if (c & 0x80)
+         {
+            i += (c & 0x7f) + 1;
+            continue;
+         }
+         MFEM_VERIFY(c >= 1 && c <= 8 && p + c <= payload.size(),
+                     "corrupt history frame");
+         uint64_t w = 0;
+         for (int b = 0; b < c; b++)
+         {
+            w |= (uint64_t)(unsigned char)payload[p++] << (8*b);
+         }
+         prev[i++] ^= w;
+      }
+      MFEM_VERIFY(i == n, "corrupt history frame");
+   }
+   for (i = 0; i < n; i++) { memcpy(&data[i], &prev[i], sizeof(double)); }
+}
+
+// Streams iterates to an append-only binary file. Frames are copied into a
+// bounded queue by the caller and encoded/written by a background thread,
+// so memory use is independent of the number of iterations.
+class HistoryWriter : private HistoryCodec
+{
+private:
+   std::ofstream out;
+   int size;
+   BoundedQueue<HistoryFrame> queue;
+   std::thread worker;
+   bool open;
+
+   void Run();
+
+public:
+   HistoryWriter(const char *fname, int size_, int encoding_, int buffer);
+
+   // Copy 'size' values from 'data' into the queue. Blocks if the buffer is
+   // full until the writer thread catches up.
+   void Append(int iteration, const double *data);
+
+   // Flush all pending frames and stop the writer thread.
+   void Close();
+
+   ~HistoryWriter() { Close(); }
+};
+
+HistoryWriter::HistoryWriter(const char *fname, int size_, int encoding_,
+                             int buffer)
+   : HistoryCodec(encoding_, size_), out(fname, ios::out | ios::binary),
+     size(size_), queue(buffer), open(true)
+{
+   MFEM_VERIFY(encoding >= HIST_RAW && encoding <= HIST_COMPRESSED,
+               "unknown history encoding " << encoding);
+   MFEM_VERIFY(out, "cannot open history file " << fname);
+   int32_t enc = encoding;
+   int64_t n = size;
+   out.write(hist_magic, sizeof(hist_magic));
+   out.write((const char*)&enc, sizeof(enc));
+   out.write((const char*)&n, sizeof(n));
+   MFEM_VERIFY(out, "error writing history file " << fname);
+   worker = std::thread(&HistoryWriter::Run, this);
+}
+
+void HistoryWriter::Append(int iteration, const double *data)
+{
+   HistoryFrame frame;
+   frame.iteration = iteration;
+   frame.data.assign(data, data + size);
+   queue.Push(std::move(frame));
+}
+
+void HistoryWriter::Run()
+{
+   HistoryFrame frame;
+   while (queue.Pop(frame))
+   {
+      Encode(frame.data);
+      int32_t its = frame.iteration;
+      uint64_t nbytes = payload.size();
+      out.write((const char*)&its, sizeof(its));
+      out.write((const char*)&nbytes, sizeof(nbytes));
+      out.write(payload.data(), nbytes);
+      MFEM_VERIFY(out, "error writing iteration " << its << " to the history file");
+   }
+   out.flush();
+   MFEM_VERIFY(out, "error writing the history file");
+}
+
+void HistoryWriter::Close()
+{
+   if (!open) { return; }
+   queue.Close();
+   worker.join();
+   out.close();
+   MFEM_VERIFY(out, "error closing the history file");
+   open = false;
+}
+
+// Sequential reader for files produced by HistoryWriter
+class HistoryReader : private HistoryCodec
+{
+private:
+   std::ifstream in;
+
+public:
+   HistoryReader(const char *fname);
+
+   int Size() const { return (int)prev.size(); }
+
+   // Read and decode the next frame; returns false at the end of the file.
+   bool Next(HistoryFrame &frame);
+};
+
+HistoryReader::HistoryReader(const char *fname)
+   : HistoryCodec(HIST_RAW, 0), in(fname, ios::in | ios::binary)
+{
+   MFEM_VERIFY(in, "cannot open history file " << fname);
+   char magic[sizeof(hist_magic)];
+   int32_t enc;
+   int64_t n;
+   in.read(magic, sizeof(magic));
+   in.read((char*)&enc, sizeof(enc));
+   in.read((char*)&n, sizeof(n));
+   MFEM_VERIFY(in && memcmp(magic, hist_magic, sizeof(magic)) == 0 && n >= 0 &&
+               enc >= HIST_RAW && enc <= HIST_COMPRESSED,
+               "invalid history file " << fname);
+   encoding = enc;
+   prev.assign(n, 0);
+}
+
+bool HistoryReader::Next(HistoryFrame &frame)
+{
+   int32_t its;
+   uint64_t nbytes;
+   if (!in.read((char*)&its, sizeof(its))) { return false; }
+   in.read((char*)&nbytes, sizeof(nbytes));
+   MFEM_VERIFY(in && nbytes <= MaxPayload(), "corrupt history frame");
+   payload.resize(nbytes);
+   in.read(payload.data(), nbytes);
+   MFEM_VERIFY(in, "truncated history file");
+   frame.iteration = its;
+   Decode(frame.data);
+   return true;
+}
+
+// Call counts and wall-clock times of the TAO callbacks during one solve.
+// Time spent inside TAO itself is t_solve minus the callback times. The type
+// is the one TAO actually ran, after -tao_type had its say.
+typedef struct {
+  char           type[32];
+  PetscInt       its, nlits;
+  PetscInt       nfg, nhv, nmon, nspmv;
+  PetscLogDouble t_fg, t_hv, t_mon, t_solve;
+} SolveStats;
+
 // Context that carries the necessary MFEM data structures inside TAO
 typedef struct {
-  SparseMatrix A;
-  Vector U, LB, UB, work;
-  vector <Vector> hist;
+  MPI_Comm comm;
+  ParBilinearForm *a;
+  HypreParMatrix A;
+  Array<int> ess_tdof_list;
+  Vector U, work;
+  Vector coords;   // coordinates of the local true dofs, x block then y block
+  HistoryWriter *hist;
+  int hist_stride, hist_last;
   int size;
-  Mat H;
+  Mat H, Hpre;
+  // local rows of A in PETSc AIJ layout, shared with Hpre
+  std::vector<PetscInt> di, dj, oi, oj;
+  std::vector<PetscScalar> da, oa;
+  bool report_lits;
+  PetscInt lits_last;
+  SolveStats stats;
 } AppCtx;
 
 // TAO function call-back for computing the objective value and its gradient vector
@@ -63,30 +516,54 @@ PetscErrorCode FormFunctionGradient(Tao tao, Vec X, PetscReal *fcn,Vec G,void *p
   const PetscReal *xx;
   PetscReal *gg;
   PetscReal gnorm;
+  PetscLogDouble t0, t1;
   
+  ierr = PetscTime(&t0);CHKERRQ(ierr);
   ierr = VecGetArrayRead(X, &xx);
   data = user->U.GetData();
   for (int i=0; i<user->size; ++i) data[i] = xx[i];
   ierr = VecRestoreArrayRead(X, &xx);
   
-  *fcn = 0.5 * user->A.InnerProduct(user->U, user->U);
-  
   user->A.Mult(user->U, user->work);
+  *fcn = 0.5 * InnerProduct(user->comm, user->U, user->work);
+  
   ierr = VecGetArray(G, &gg);
   for (int i=0; i<user->size; ++i) gg[i] = user->work(i);
   ierr = VecRestoreArray(G, &gg);
   ierr = VecNorm(G, NORM_2, &gnorm);
   
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  user->stats.nfg++;
+  user->stats.nspmv++;
+  user->stats.t_fg += t1 - t0;
+  
   return 0;
 }
 
 // TAO Hessian call-back does nothing because we use a "matrix-free" Hessian shell
+// and the optional assembled preconditioning matrix never changes
 PetscErrorCode FormHessian(Tao tao,Vec X,Mat hes, Mat Hpre, void *ptr)
 {
   return 0;
 }
 
-// User-defined TAO monitor that stores copies of the solution vector at each iteration
+// Append the current TAO solution to the history stream
+PetscErrorCode RecordIterate(Tao tao, AppCtx *user, PetscInt its)
+{
+  PetscErrorCode  ierr;
+  Vec             X;
+  const PetscReal *xx;
+  
+  ierr = TaoGetSolutionVector(tao, &X);CHKERRQ(ierr);
+  ierr = VecGetArrayRead(X, &xx);CHKERRQ(ierr);
+  user->hist->Append(its, xx);
+  ierr = VecRestoreArrayRead(X, &xx);CHKERRQ(ierr);
+  user->hist_last = its;
+  
+  return 0;
+}
+
+// User-defined TAO monitor that streams every hist_stride-th iterate to disk
 PetscErrorCode Monitor(Tao tao, void *ctx)
 {
   AppCtx             *user = (AppCtx*) ctx;
@@ -94,12 +571,27 @@ PetscErrorCode Monitor(Tao tao, void *ctx)
   PetscInt           its;
   PetscReal          f, gnorm, cnorm, xdiff;
   TaoConvergedReason reason;
+  PetscLogDouble     t0, t1;
   
+  ierr = PetscTime(&t0);CHKERRQ(ierr);
   ierr = TaoGetSolutionStatus(tao, &its, &f, &gnorm, &cnorm, &xdiff, &reason);CHKERRQ(ierr);
   
-  // store the history of the solutution
-  Vector new_sol(user->U);
-  user->hist.push_back(new_sol);
+  // store the history of the solution
+  if (user->hist && its % user->hist_stride == 0) {
+    ierr = RecordIterate(tao, user, its);CHKERRQ(ierr);
+  }
+  
+  // report the Krylov iterations spent since the last TAO iteration
+  if (user->report_lits) {
+    PetscInt lits;
+    ierr = TaoGetLinearSolveIterations(tao, &lits);CHKERRQ(ierr);
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "  TAO iteration %D: %D KSP iterations (%D total)\n", its, lits - user->lits_last, lits);CHKERRQ(ierr);
+    user->lits_last = lits;
+  }
+  
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  user->stats.nmon++;
+  user->stats.t_mon += t1 - t0;
   
   return 0;
 }
@@ -111,7 +603,9 @@ PetscErrorCode StiffMult(Mat A, Vec X, Vec Y)
   PetscErrorCode ierr;
   const double *xx;
   double *data, *yy;
+  PetscLogDouble t0, t1;
   
+  ierr = PetscTime(&t0);CHKERRQ(ierr);
   ierr = MatShellGetContext(A, &user);CHKERRQ(ierr);
   
   ierr = VecGetArrayRead(X, &xx);CHKERRQ(ierr);
@@ -126,22 +620,573 @@ PetscErrorCode StiffMult(Mat A, Vec X, Vec Y)
   for (int i=0; i<user->size; ++i) yy[i] = data[i];
   ierr = VecRestoreArray(Y, &yy);CHKERRQ(ierr);
   
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  user->stats.nhv++;
+  user->stats.nspmv++;
+  user->stats.t_hv += t1 - t0;
+  
+  return 0;
+}
+
+// Global indices are HYPRE_BigInt since hypre 2.16, wider than HYPRE_Int in
+// mixed-int builds. MFEM 4.1 and later provide the type for older hypre.
+#if !defined(MFEM_HYPRE_VERSION) && \
+    (!defined(HYPRE_RELEASE_NUMBER) || HYPRE_RELEASE_NUMBER < 21600)
+typedef HYPRE_Int HYPRE_BigInt;
+#endif
+
+// Reorder one hypre CSR block into sorted AIJ rows. Columns of the
+// off-diagonal block are mapped to global indices through 'cmap'.
+void SortedCSR(hypre_CSRMatrix *csr, const HYPRE_BigInt *cmap,
+               std::vector<PetscInt> &I, std::vector<PetscInt> &J,
+               std::vector<PetscScalar> &V)
+{
+   const HYPRE_Int *ci = hypre_CSRMatrixI(csr);
+   const HYPRE_Int *cj = hypre_CSRMatrixJ(csr);
+   const double *cv = hypre_CSRMatrixData(csr);
+   const int m = hypre_CSRMatrixNumRows(csr);
+   const int nnz = ci[m];
+
+   // one extra entry keeps the pointers valid for an empty block
+   I.resize(m + 1);
+   J.resize(nnz + 1);
+   V.resize(nnz + 1);
+   std::vector<std::pair<PetscInt, PetscScalar> > row;
+   for (int i = 0; i <= m; i++) { I[i] = ci[i]; }
+   for (int i = 0; i < m; i++)
+   {
+      row.clear();
+      for (int k = ci[i]; k < ci[i+1]; k++)
+      {
+         row.push_back(std::make_pair((PetscInt)(cmap ? cmap[cj[k]] : cj[k]),
+                                      (PetscScalar)cv[k]));
+      }
+      std::sort(row.begin(), row.end());
+      for (int k = ci[i]; k < ci[i+1]; k++)
+      {
+         J[k] = row[k - ci[i]].first;
+         V[k] = row[k - ci[i]].second;
+      }
+   }
+}
+
+// Create a PETSc AIJ matrix from the local rows of the stiffness matrix, to
+// be used as the preconditioning matrix of the Hessian shell. hypre stores
+// the diagonal entry first in each row and compresses the off-diagonal
+// columns, so the CSR data is reordered once into AppCtx storage, which
+// PETSc then uses in place without copying.
+PetscErrorCode CreateAssembledHessian(AppCtx *user)
+{
+  PetscErrorCode     ierr;
+  hypre_ParCSRMatrix *h = (hypre_ParCSRMatrix*) user->A;
+  
+  SortedCSR(hypre_ParCSRMatrixDiag(h), NULL, user->di, user->dj, user->da);
+  SortedCSR(hypre_ParCSRMatrixOffd(h), hypre_ParCSRMatrixColMapOffd(h),
+            user->oi, user->oj, user->oa);
+  
+  ierr = MatCreateMPIAIJWithSplitArrays(PETSC_COMM_WORLD, user->size, user->size, PETSC_DETERMINE, PETSC_DETERMINE,
+                                        user->di.data(), user->dj.data(), user->da.data(),
+                                        user->oi.data(), user->oj.data(), user->oa.data(), &user->Hpre);CHKERRQ(ierr);
+  ierr = MatSetOption(user->Hpre, MAT_SYMMETRIC, PETSC_TRUE);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// Physical coordinates of a point, used to find the true-dof coordinates
+void Coordinates(const Vector &x, Vector &y)
+{
+   y = x;
+}
+
+// Assemble the stiffness matrix, find the essential true dofs and gather
+// the true-dof coordinates on the current mesh. The previous bilinear form
+// (if any) is replaced, since A references the matrix it owns.
+void AssembleProblem(ParFiniteElementSpace *fespace, AppCtx *user)
+{
+   ParMesh *pmesh = fespace->GetParMesh();
+   user->ess_tdof_list.SetSize(0);
+   if (pmesh->bdr_attributes.Size())
+   {
+      Array<int> ess_bdr(pmesh->bdr_attributes.Max());
+      ess_bdr = 1;
+      fespace->GetEssentialTrueDofs(ess_bdr, user->ess_tdof_list);
+   }
+
+   ConstantCoefficient one(1.0);
+   ParBilinearForm *a = new ParBilinearForm(fespace);
+   a->AddDomainIntegrator(new DiffusionIntegrator(one));
+   a->Assemble();
+   a->FormSystemMatrix(user->ess_tdof_list, user->A);
+   delete user->a;
+   user->a = a;
+
+   user->comm = pmesh->GetComm();
+   user->size = user->A.Height();
+   user->U.SetSize(user->size);
+   user->U = 0.0;
+   user->work.SetSize(user->size);
+   user->work = 0.0;
+
+   // Gather the coordinates of the true dofs into contiguous arrays, so that
+   // the obstacle kernels can evaluate the bounds without per-point calls.
+   const int dim = pmesh->Dimension();
+   MFEM_VERIFY(dim >= 2, "the obstacle problem requires a 2D or 3D mesh");
+   ParFiniteElementSpace vfes(pmesh, fespace->FEColl(), dim, Ordering::byNODES);
+   ParGridFunction nodes(&vfes);
+   VectorFunctionCoefficient identity(dim, Coordinates);
+   nodes.ProjectCoefficient(identity);
+   nodes.GetTrueDofs(user->coords);
+}
+
+// Compute the lower and upper bounds directly in the PETSc bound vectors.
+// Both bounds are zero at the boundary of the mesh. Lower bound includes the
+// obstacle function, evaluated by its kernel over the true-dof coordinates,
+// while the upper bound is "infinity".
+PetscErrorCode SetBounds(AppCtx *user, const ObstacleParams &p, Vec XL, Vec XU)
+{
+  PetscErrorCode ierr;
+  PetscReal      *xl, *xu;
+  const double   *x = user->coords.GetData();
+  const double   *y = x + user->size;
+  
+  ierr = VecSet(XU, PETSC_INFINITY);CHKERRQ(ierr);
+  ierr = VecGetArray(XL, &xl);CHKERRQ(ierr);
+  ierr = VecGetArray(XU, &xu);CHKERRQ(ierr);
+  ObstacleShapes()[p.shape].kernel(p, user->size, x, y, xl);
+  for (int i = 0; i < user->ess_tdof_list.Size(); i++) {
+    xl[user->ess_tdof_list[i]] = 0.0;
+    xu[user->ess_tdof_list[i]] = 0.0;
+  }
+  ierr = VecRestoreArray(XU, &xu);CHKERRQ(ierr);
+  ierr = VecRestoreArray(XL, &xl);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// Create the distributed PETSc solution and bound vectors, the shell matrix
+// that performs the "matrix-free" Hessian-vector product required by TAO
+// and, optionally, the assembled Hessian preconditioning matrix.
+PetscErrorCode CreatePetscObjects(AppCtx *user, PetscBool assembled_hpre, Vec *X, Vec *XL, Vec *XU)
+{
+  PetscErrorCode ierr;
+  
+  ierr = VecCreateMPI(PETSC_COMM_WORLD, user->size, PETSC_DETERMINE, X);CHKERRQ(ierr);
+  ierr = VecSet(*X, 1.0);CHKERRQ(ierr);
+  ierr = VecDuplicate(*X, XL);CHKERRQ(ierr);
+  ierr = VecDuplicate(*X, XU);CHKERRQ(ierr);
+  
+  ierr = MatCreateShell(PETSC_COMM_WORLD, user->size, user->size, PETSC_DETERMINE, PETSC_DETERMINE, (void*) user, &user->H);CHKERRQ(ierr);
+  ierr = MatShellSetOperation(user->H, MATOP_MULT, (void(*)(void))StiffMult);CHKERRQ(ierr);
+  
+  // Optionally, hand the assembled stiffness matrix to TAO so that the
+  // -tao_*/-ksp_* options can pick a preconditioner (ICC, GAMG, ...) for it.
+  user->Hpre = NULL;
+  if (assembled_hpre) {
+    ierr = CreateAssembledHessian(user);CHKERRQ(ierr);
+  }
+  
+  return 0;
+}
+
+PetscErrorCode DestroyPetscObjects(AppCtx *user, Vec *X, Vec *XL, Vec *XU)
+{
+  PetscErrorCode ierr;
+  
+  ierr = VecDestroy(X);CHKERRQ(ierr);
+  ierr = VecDestroy(XU);CHKERRQ(ierr);
+  ierr = VecDestroy(XL);CHKERRQ(ierr);
+  ierr = MatDestroy(&user->H);CHKERRQ(ierr);
+  ierr = MatDestroy(&user->Hpre);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// Create the TAO optimization algorithm of the given type, configure it and
+// solve the problem starting from the current contents of X. The options
+// database may still change the type. The callback statistics of the solve,
+// including the type that ran, are left in user->stats.
+PetscErrorCode SolveObstacle(AppCtx *user, TaoType type, Vec X, Vec XL, Vec XU, PetscInt *its)
+{
+  PetscErrorCode ierr;
+  Tao            tao;
+  TaoType        ran;
+  PetscLogDouble t0, t1;
+  
+  user->hist_last = -1;
+  user->lits_last = 0;
+  ierr = PetscMemzero(&user->stats, sizeof(SolveStats));CHKERRQ(ierr);
+  
+  ierr = TaoCreate(PETSC_COMM_WORLD, &tao);CHKERRQ(ierr);
+  ierr = TaoSetType(tao, type);CHKERRQ(ierr);
+  ierr = TaoSetInitialVector(tao, X);CHKERRQ(ierr);
+  ierr = TaoSetObjectiveAndGradientRoutine(tao, FormFunctionGradient, (void*) user);CHKERRQ(ierr);
+  ierr = TaoSetHessianRoutine(tao, user->H, user->Hpre ? user->Hpre : user->H, FormHessian, (void*) user);CHKERRQ(ierr);
+  ierr = TaoSetVariableBounds(tao, XL, XU);CHKERRQ(ierr);
+  ierr = TaoSetMonitor(tao, Monitor, user, NULL);CHKERRQ(ierr);
+  ierr = TaoSetFromOptions(tao);CHKERRQ(ierr);
+  ierr = TaoGetType(tao, &ran);CHKERRQ(ierr);
+  ierr = PetscStrncpy(user->stats.type, ran, sizeof(user->stats.type));CHKERRQ(ierr);
+  ierr = PetscTime(&t0);CHKERRQ(ierr);
+  ierr = TaoSolve(tao);CHKERRQ(ierr);
+  ierr = PetscTime(&t1);CHKERRQ(ierr);
+  user->stats.t_solve = t1 - t0;
+  ierr = TaoGetSolutionStatus(tao, its, NULL, NULL, NULL, NULL, NULL);CHKERRQ(ierr);
+  ierr = TaoGetLinearSolveIterations(tao, &user->stats.nlits);CHKERRQ(ierr);
+  user->stats.its = *its;
+  
+  // make sure the final iterate ends up in the history
+  if (user->hist && *its != user->hist_last) {
+    ierr = RecordIterate(tao, user, *its);CHKERRQ(ierr);
+  }
+  
+  ierr = TaoDestroy(&tao);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// Print the callback statistics of the last solve
+PetscErrorCode PrintStats(const SolveStats &st)
+{
+  PetscErrorCode ierr;
+  PetscLogDouble t_cb = st.t_fg + st.t_hv + st.t_mon;
+  
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "TAO %s solve: %D iterations, %D KSP iterations, %g s\n", st.type, st.its, st.nlits, st.t_solve);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "  %-20s %8s %12s %12s\n", "callback", "calls", "time (s)", "per call (s)");CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "  %-20s %8D %12.4e %12.4e\n", "FormFunctionGradient", st.nfg, st.t_fg, st.nfg ? st.t_fg/st.nfg : 0.0);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "  %-20s %8D %12.4e %12.4e\n", "StiffMult", st.nhv, st.t_hv, st.nhv ? st.t_hv/st.nhv : 0.0);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "  %-20s %8D %12.4e %12.4e\n", "Monitor", st.nmon, st.t_mon, st.nmon ? st.t_mon/st.nmon : 0.0);CHKERRQ(ierr);
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "  %D SpMVs with the stiffness matrix, %g s inside TAO\n", st.nspmv, st.t_solve - t_cb);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// Solution of a batch obstacle, kept to warm start the following ones
+struct BatchSolution {
+  ObstacleParams p;
+  Vector x;
+  std::vector<char> active;
+};
+
+// Index of the previously solved obstacle of the same shape that is closest
+// to 'p' in parameter space, or -1 if there is none
+int NearestSolution(const std::vector<BatchSolution> &sols, const ObstacleParams &p)
+{
+   int nearest = -1;
+   double dmin = 0.0;
+   for (size_t k = 0; k < sols.size(); k++)
+   {
+      const ObstacleParams &q = sols[k].p;
+      if (q.shape != p.shape) { continue; }
+      double d = fabs(q.size - p.size) + fabs(q.thickness - p.thickness) +
+                 fabs(q.height - p.height);
+      if (nearest < 0 || d < dmin)
+      {
+         nearest = (int)k;
+         dmin = d;
+      }
+   }
+   return nearest;
+}
+
+// Solve the obstacle problem for every entry of 'obstacles' with the already
+// assembled operator and PETSc objects in 'user'. Only the bounds change
+// between solves. With warm_start, each solve starts from the solution of the
+// nearest previous obstacle, with its active set moved onto the new obstacle.
+// Only the 'keep' most recent solutions of each shape are stored for this, one
+// double and one char per local dof each.
+// The final solutions are appended to 'sink', one frame per obstacle. With
+// report_stats, the table also lists the callback statistics of every solve.
+PetscErrorCode SolveBatch(AppCtx *user, Vec X, Vec XL, Vec XU,
+                          const std::vector<ObstacleParams> &obstacles, PetscBool warm_start,
+                          PetscInt keep, PetscBool report_stats, HistoryWriter *sink)
+{
+  PetscErrorCode ierr;
+  PetscReal      *xx;
+  const PetscReal *xl;
+  std::vector<BatchSolution> sols;
+  double         total = 0.0;
+  
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "%4s %-6s %9s %9s %9s %5s %6s %10s", "#", "shape", "size", "thickness", "height", "warm", "its", "time (s)");CHKERRQ(ierr);
+  if (report_stats) {
+    ierr = PetscPrintf(PETSC_COMM_WORLD, " %7s %7s %7s %8s %10s", "ksp its", "f/g", "Hv", "SpMV", "TAO (s)");CHKERRQ(ierr);
+  }
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\n");CHKERRQ(ierr);
+  for (size_t k = 0; k < obstacles.size(); k++) {
+    const ObstacleParams &p = obstacles[k];
+    StopWatch timer;
+    timer.Start();
+    
+    ierr = SetBounds(user, p, XL, XU);CHKERRQ(ierr);
+    
+    int from = warm_start ? NearestSolution(sols, p) : -1;
+    ierr = VecGetArrayRead(XL, &xl);CHKERRQ(ierr);
+    ierr = VecGetArray(X, &xx);CHKERRQ(ierr);
+    for (int i=0; i<user->size; ++i) {
+      if (from < 0) {
+        xx[i] = 1.0;
+      } else if (sols[from].active[i] && xl[i] > PETSC_NINFINITY) {
+        xx[i] = xl[i];
+      } else {
+        xx[i] = sols[from].x(i);
+      }
+    }
+    ierr = VecRestoreArray(X, &xx);CHKERRQ(ierr);
+    ierr = VecRestoreArrayRead(XL, &xl);CHKERRQ(ierr);
+    ierr = VecMedian(XL, X, XU, X);CHKERRQ(ierr);
+    
+    PetscInt its;
+    ierr = SolveObstacle(user, TAOBNLS, X, XL, XU, &its);CHKERRQ(ierr);
+    timer.Stop();
+    total += timer.RealTime();
+    
+    // keep the solution and the dofs in contact with the obstacle, evicting
+    // the oldest solution of the same shape beyond 'keep'
+    ierr = VecGetArrayRead(XL, &xl);CHKERRQ(ierr);
+    ierr = VecGetArray(X, &xx);CHKERRQ(ierr);
+    if (warm_start && keep > 0) {
+      int nshape = 0, oldest = -1;
+      for (size_t j = 0; j < sols.size(); j++) {
+        if (sols[j].p.shape != p.shape) continue;
+        if (oldest < 0) oldest = (int)j;
+        nshape++;
+      }
+      if (nshape >= keep) sols.erase(sols.begin() + oldest);
+      sols.push_back(BatchSolution());
+      BatchSolution &sol = sols.back();
+      sol.p = p;
+      sol.x.SetSize(user->size);
+      sol.active.resize(user->size);
+      for (int i=0; i<user->size; ++i) {
+        sol.x(i) = xx[i];
+        sol.active[i] = (xl[i] > PETSC_NINFINITY && xx[i] - xl[i] <= 1e-8);
+      }
+    }
+    if (sink) sink->Append((int)k, xx);
+    ierr = VecRestoreArray(X, &xx);CHKERRQ(ierr);
+    ierr = VecRestoreArrayRead(XL, &xl);CHKERRQ(ierr);
+    
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "%4d %-6s %9.4f %9.4f %9.4f %5s %6D %10.4f", (int)k, ObstacleShapes()[p.shape].name.c_str(), p.size, p.thickness, p.height, from < 0 ? "no" : "yes", its, timer.RealTime());CHKERRQ(ierr);
+    if (report_stats) {
+      const SolveStats &st = user->stats;
+      ierr = PetscPrintf(PETSC_COMM_WORLD, " %7D %7D %7D %8D %10.4f", st.nlits, st.nfg, st.nhv, st.nspmv, st.t_solve - st.t_fg - st.t_hv - st.t_mon);CHKERRQ(ierr);
+    }
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "\n");CHKERRQ(ierr);
+  }
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "Total solve time for %d obstacles: %g s\n", (int)obstacles.size(), total);CHKERRQ(ierr);
+  
+  return 0;
+}
+
+// One configuration of the benchmark mode
+struct BenchmarkRow {
+  int order, par_ref;
+  HYPRE_BigInt dofs;
+  SolveStats stats;
+};
+
+// Solve the default ring obstacle for every combination of FE order,
+// parallel refinement level and TAO type, always starting from the same
+// initial guess, and print a table comparing the solves. Rows are labelled
+// with the type TAO ran, so a -tao_type on the command line shows up there.
+PetscErrorCode RunBenchmark(Mesh *mesh, AppCtx *user, const Array<int> &orders,
+                            const Array<int> &par_refs, const std::vector<string> &types,
+                            PetscBool assembled_hpre)
+{
+  PetscErrorCode ierr;
+  Vec            X, XL, XU;
+  ObstacleParams ring = { OBS_RING, 0.4, 0.05, 1.0 };
+  std::vector<BenchmarkRow> rows;
+  
+  for (int o = 0; o < orders.Size(); o++) {
+    for (int r = 0; r < par_refs.Size(); r++) {
+      MFEM_VERIFY(orders[o] > 0, "benchmark orders must be positive");
+      ParMesh *pmesh = new ParMesh(MPI_COMM_WORLD, *mesh);
+      for (int l = 0; l < par_refs[r]; l++) {
+        pmesh->UniformRefinement();
+      }
+      FiniteElementCollection *fec = new H1_FECollection(orders[o], pmesh->Dimension());
+      ParFiniteElementSpace *fespace = new ParFiniteElementSpace(pmesh, fec);
+      
+      AssembleProblem(fespace, user);
+      ierr = CreatePetscObjects(user, assembled_hpre, &X, &XL, &XU);CHKERRQ(ierr);
+      ierr = SetBounds(user, ring, XL, XU);CHKERRQ(ierr);
+      
+      for (size_t t = 0; t < types.size(); t++) {
+        PetscInt its;
+        ierr = VecSet(X, 1.0);CHKERRQ(ierr);
+        ierr = SolveObstacle(user, types[t].c_str(), X, XL, XU, &its);CHKERRQ(ierr);
+        BenchmarkRow row;
+        row.order = orders[o];
+        row.par_ref = par_refs[r];
+        row.dofs = user->A.GetGlobalNumRows();
+        row.stats = user->stats;
+        rows.push_back(row);
+      }
+      
+      ierr = DestroyPetscObjects(user, &X, &XL, &XU);CHKERRQ(ierr);
+      delete user->a;
+      user->a = NULL;
+      delete fespace;
+      delete fec;
+      delete pmesh;
+    }
+  }
+  
+  ierr = PetscPrintf(PETSC_COMM_WORLD, "\n%-8s %5s %4s %10s %10s %6s %7s %7s %7s %8s %10s\n", "type", "order", "ref", "dofs", "time (s)", "its", "ksp its", "f/g", "Hv", "SpMV", "TAO (s)");CHKERRQ(ierr);
+  for (size_t k = 0; k < rows.size(); k++) {
+    const SolveStats &st = rows[k].stats;
+    ierr = PetscPrintf(PETSC_COMM_WORLD, "%-8s %5d %4d %10ld %10.4f %6D %7D %7D %7D %8D %10.4f\n", st.type, rows[k].order, rows[k].par_ref, (long)rows[k].dofs, st.t_solve, st.its, st.nlits, st.nfg, st.nhv, st.nspmv, st.t_solve - st.t_fg - st.t_hv - st.t_mon);CHKERRQ(ierr);
+  }
+  
   return 0;
 }
 
+// Layout of the VisIt output. SaveHistory applies it to the collection that
+// writes the root files and uses it for the per-rank files, so the paths in
+// the root files always match the files on disk.
+static const char vis_name[] = "obstacle";
+static const char vis_field[] = "solution";
+static const int vis_pad_digits = 6;
+static const int vis_precision = 6;
+
+// One cycle directory of VisIt output, handed to the SaveHistory writers
+struct VisJob {
+  string dir;
+  ParGridFunction *xc;
+};
+
+// Write the iterate history to VisIt. A reader thread decodes the file
+// sequentially (delta frames depend on their predecessor) and hands the frames
+// to the calling thread, which does everything that communicates: prolonging
+// each frame with SetFromTrueDofs() and creating its cycle directory (rank 0
+// creates it, the broadcast makes the other ranks wait for it). The per-rank
+// mesh and field files are then written concurrently by 'nthreads' workers,
+// which make no MPI calls, and rank 0 writes the root file. The files follow
+// the VisItDataCollection layout, so VisIt opens the .mfem_root files as
+// before. No forms are assembled here: the true-dof prolongation of fespace
+// is built once.
+void SaveHistory(const char *hist_file, ParMesh *pmesh,
+                 ParFiniteElementSpace *fespace, int nthreads)
+{
+   HistoryReader reader(hist_file);
+   const int size = fespace->GetTrueVSize();
+   MFEM_VERIFY(reader.Size() == size, "history size does not match the problem");
+   if (nthreads < 1) { nthreads = 1; }
+   const int myid = pmesh->GetMyRank();
+   const string rank = "." + to_padded_string(myid, vis_pad_digits);
+   const string mesh_base = string("/mesh") + rank;
+   const string field_base = string("/") + vis_field + rank;
+
+   BoundedQueue<HistoryFrame> frames(4);
+   std::thread decoder([&]()
+   {
+      HistoryFrame frame;
+      while (reader.Next(frame))
+      {
+         frames.Push(std::move(frame));
+      }
+      frames.Close();
+   });
+
+   // the local mesh is the same in every cycle, print it once
+   ostringstream mesh_out;
+   mesh_out.precision(vis_precision);
+   pmesh->Print(mesh_out);
+   const string mesh_str = mesh_out.str();
+
+   BoundedQueue<VisJob> jobs(2*nthreads);
+   std::vector<std::thread> workers;
+   for (int t = 0; t < nthreads; t++)
+   {
+      workers.push_back(std::thread([&]()
+      {
+         VisJob job;
+         while (jobs.Pop(job))
+         {
+            ofstream mesh_file((job.dir + mesh_base).c_str());
+            mesh_file << mesh_str;
+            MFEM_VERIFY(mesh_file, "error writing " << job.dir << mesh_base);
+            ofstream field_file((job.dir + field_base).c_str());
+            field_file.precision(vis_precision);
+            job.xc->Save(field_file);
+            MFEM_VERIFY(field_file, "error writing " << job.dir << field_base);
+            delete job.xc;
+         }
+      }));
+   }
+
+   // describes the mesh and the field in the root files only
+   ParGridFunction root_gf(fespace);
+   VisItDataCollection visit_dc(vis_name, pmesh);
+   visit_dc.SetPadDigits(vis_pad_digits);
+   visit_dc.SetPrecision(vis_precision);
+   visit_dc.RegisterField(vis_field, &root_gf);
+
+   int cycle = 0;
+   HistoryFrame frame;
+   while (frames.Pop(frame))
+   {
+      VisJob job;
+      job.dir = string(vis_name) + "_" +
+                to_padded_string(cycle, vis_pad_digits);
+      int err = 0;
+      if (myid == 0)
+      {
+         err = (mkdir(job.dir.c_str(), 0777) != 0 && errno != EEXIST);
+      }
+      MPI_Bcast(&err, 1, MPI_INT, 0, pmesh->GetComm());
+      MFEM_VERIFY(!err, "cannot create directory " << job.dir);
+
+      Vector X(frame.data.data(), size);
+      job.xc = new ParGridFunction(fespace);
+      job.xc->SetFromTrueDofs(X);
+      if (myid == 0)
+      {
+         visit_dc.SetCycle(cycle);
+         visit_dc.SetTime(frame.iteration);
+         visit_dc.SaveRootFile();
+      }
+      jobs.Push(std::move(job));
+      cycle++;
+   }
+   decoder.join();
+   jobs.Close();
+   for (int t = 0; t < nthreads; t++) { workers[t].join(); }
+}
+
 int main(int argc, char *argv[])
 {
-   // 1. Parse command-line options.
+   // 1. Initialize MPI.
+   int num_procs, myid;
+   MPI_Init(&argc, &argv);
+   MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+   MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+
+   // 2. Parse command-line options.
    const char *mesh_file = "star.mesh";
    int order = 1;
+   int ser_ref_levels = 4;
+   int par_ref_levels = 1;
    bool static_cond = false;
    bool visualization = 1;
-   double fcn, prod_norm;
+   int vis_threads = 2;
+   const char *hist_file = "obstacle_hist.bin";
+   int hist_stride = 1;
+   int hist_encoding = HIST_COMPRESSED;
+   int hist_buffer = 16;
+   bool assembled_hpre = false;
+   bool report_lits = false;
+   bool grid_sequence = false;
+   const char *batch_file = "";
+   bool warm_start = true;
+   int warm_keep = 8;
+   bool report_stats = false;
+   bool benchmark = false;
+   const char *bench_types = "bnls bntr bqnls blmvm";
+   Array<int> bench_orders, bench_refs;
    PetscErrorCode ierr;
    AppCtx user;
-   Tao tao;
    Vec X, XL, XU;
-   PetscReal *bounds;
 
    OptionsParser args(argc, argv);
    args.AddOption(&mesh_file, "-m", "--mesh",
@@ -149,185 +1194,267 @@ int main(int argc, char *argv[])
    args.AddOption(&order, "-o", "--order",
                   "Finite element order (polynomial degree) or -1 for"
                   " isoparametric space.");
+   args.AddOption(&ser_ref_levels, "-rs", "--refine-serial",
+                  "Number of times to refine the mesh uniformly in serial.");
+   args.AddOption(&par_ref_levels, "-rp", "--refine-parallel",
+                  "Number of times to refine the mesh uniformly in parallel.");
    args.AddOption(&visualization, "-vis", "--visualization", "-no-vis",
                   "--no-visualization",
                   "Enable or disable GLVis visualization.");
+   args.AddOption(&vis_threads, "-vt", "--vis-threads",
+                  "Number of threads per rank writing VisIt output.");
+   args.AddOption(&hist_file, "-hf", "--hist-file",
+                  "File that the iterate history is streamed to"
+                  " (one per rank, suffixed with the rank number).");
+   args.AddOption(&hist_stride, "-hs", "--hist-stride",
+                  "Store every n-th TAO iterate in the history.");
+   args.AddOption(&hist_encoding, "-he", "--hist-encoding",
+                  "History encoding: 0 - raw, 1 - delta, 2 - compressed delta.");
+   args.AddOption(&hist_buffer, "-hb", "--hist-buffer",
+                  "Maximum number of iterates buffered in memory.");
+   args.AddOption(&assembled_hpre, "-hpre", "--assembled-hessian", "-no-hpre",
+                  "--no-assembled-hessian",
+                  "Give TAO the assembled stiffness matrix (PETSc AIJ) to"
+                  " build Hessian preconditioners from.");
+   args.AddOption(&report_lits, "-lits", "--linear-its", "-no-lits",
+                  "--no-linear-its",
+                  "Report the KSP iterations of every TAO iteration.");
+   args.AddOption(&grid_sequence, "-gs", "--grid-sequence", "-no-gs",
+                  "--no-grid-sequence",
+                  "Solve on every parallel refinement level, warm starting"
+                  " each level from the prolongated coarser solution.");
+   args.AddOption(&batch_file, "-b", "--batch",
+                  "File listing obstacles (\"shape size thickness [height]\""
+                  " per line) to solve with one assembled operator.");
+   args.AddOption(&warm_start, "-ws", "--warm-start", "-no-ws",
+                  "--no-warm-start",
+                  "In batch mode, start from the solution of the nearest"
+                  " previously solved obstacle.");
+   args.AddOption(&warm_keep, "-wk", "--warm-keep",
+                  "Solutions of each shape kept for warm starts; each costs"
+                  " one double and one char per dof.");
+   args.AddOption(&report_stats, "-st", "--stats", "-no-st", "--no-stats",
+                  "Report call counts and timings of the TAO callbacks.");
+   args.AddOption(&benchmark, "-bench", "--benchmark", "-no-bench",
+                  "--no-benchmark",
+                  "Compare TAO solvers over the -bt types, -bo orders and"
+                  " -br parallel refinements.");
+   args.AddOption(&bench_types, "-bt", "--bench-types",
+                  "TAO types to benchmark, e.g. \"bnls bqnls\".");
+   args.AddOption(&bench_orders, "-bo", "--bench-orders",
+                  "FE orders to benchmark, e.g. \"1 2\" (default: -o).");
+   args.AddOption(&bench_refs, "-br", "--bench-refine",
+                  "Parallel refinement levels to benchmark, e.g. \"0 1\""
+                  " (default: -rp).");
    args.Parse();
-   args.PrintOptions(cout);
+   if (hist_stride < 1) { hist_stride = 1; }
+   if (myid == 0)
+   {
+      args.PrintOptions(cout);
+   }
 
-   // 2. Read the mesh from the given mesh file.
+   // 3. Read the obstacle list in batch mode, then read the (serial) mesh
+   //    from the given mesh file on all processors.
+   std::vector<ObstacleParams> obstacles;
+   if (strlen(batch_file))
+   {
+      ReadObstacles(batch_file, obstacles);
+      MFEM_VERIFY(obstacles.size(), "no obstacles in batch file " << batch_file);
+      if (grid_sequence && myid == 0)
+      {
+         cout << "Warning: -gs has no effect in batch mode, all obstacles"
+              << " are solved on the finest mesh." << endl;
+      }
+   }
+   StopWatch setup_timer;
+   setup_timer.Start();
    Mesh *mesh = new Mesh(mesh_file, 1, 1);
    int dim = mesh->Dimension();
 
-   // 3. Refine the mesh to increase the resolution. In this example we do
-   //    'ref_levels' of uniform refinement. We choose 'ref_levels' to be the
-   //    largest number that gives a final mesh with no more than 50,000
-   //    elements.
+   // 4. Refine the serial mesh on all processors to increase the resolution.
+   //    The defaults of 4 serial and 1 parallel refinements reproduce the
+   //    roughly 20,000 element mesh of the serial version on star.mesh.
+   for (int l = 0; l < ser_ref_levels; l++)
    {
-      int ref_levels =
-         (int)floor(log(50000./mesh->GetNE())/log(2.)/dim);
-      for (int l = 0; l < ref_levels; l++)
-      {
-         mesh->UniformRefinement();
-      }
+      mesh->UniformRefinement();
+   }
+
+   // 5. In benchmark mode, every configuration builds its own parallel mesh
+   //    and finite element space from the serial mesh.
+   if (benchmark)
+   {
+      std::vector<string> types;
+      istringstream ts(bench_types);
+      string type;
+      while (ts >> type) { types.push_back(type); }
+      if (!bench_orders.Size()) { bench_orders.Append(order); }
+      if (!bench_refs.Size()) { bench_refs.Append(par_ref_levels); }
+
+      ierr = PetscInitialize( &argc, &argv,(char *)0,help );if (ierr) return ierr;
+      user.a = NULL;
+      user.hist = NULL;
+      user.report_lits = report_lits;
+      ierr = RunBenchmark(mesh, &user, bench_orders, bench_refs, types, assembled_hpre ? PETSC_TRUE : PETSC_FALSE);CHKERRQ(ierr);
+      ierr = PetscFinalize();
+      delete mesh;
+      MPI_Finalize();
+      return ierr;
    }
 
-   // 4. Define a finite element space on the mesh. Here we use continuous
-   //    Lagrange finite elements of the specified order. If order < 1, we
-   //    instead use an isoparametric/isogeometric space.
+   // 6. Define a parallel mesh by a partitioning of the serial mesh and refine
+   //    it further in parallel. With grid sequencing, the parallel refinements
+   //    happen between the solves in step 11 instead. Batch mode always
+   //    solves on the finest mesh.
+   ParMesh *pmesh = new ParMesh(MPI_COMM_WORLD, *mesh);
+   delete mesh;
+   int num_levels = (grid_sequence && !obstacles.size()) ? par_ref_levels + 1 : 1;
+   for (int l = 0; l < par_ref_levels + 1 - num_levels; l++)
+   {
+      pmesh->UniformRefinement();
+   }
+
+   // 7. Define a parallel finite element space on the parallel mesh. Here we
+   //    use continuous Lagrange finite elements of the specified order. If
+   //    order < 1, we instead use an isoparametric/isogeometric space.
    FiniteElementCollection *fec;
    if (order > 0)
    {
       fec = new H1_FECollection(order, dim);
    }
-   else if (mesh->GetNodes())
+   else if (pmesh->GetNodes())
    {
-      fec = mesh->GetNodes()->OwnFEC();
-      cout << "Using isoparametric FEs: " << fec->Name() << endl;
+      fec = pmesh->GetNodes()->OwnFEC();
+      if (myid == 0)
+      {
+         cout << "Using isoparametric FEs: " << fec->Name() << endl;
+      }
    }
    else
    {
       fec = new H1_FECollection(order = 1, dim);
    }
-   FiniteElementSpace *fespace = new FiniteElementSpace(mesh, fec);
-   cout << "Number of finite element unknowns: "
-        << fespace->GetTrueVSize() << endl;
-
-   // 5. Determine the list of true (i.e. conforming) essential boundary dofs.
-   //    In this example, the boundary conditions are defined by marking all
-   //    the boundary attributes from the mesh as essential (Dirichlet) and
-   //    converting them to a list of true dofs.
-   Array<int> ess_tdof_list;
-   if (mesh->bdr_attributes.Size())
-   {
-      Array<int> ess_bdr(mesh->bdr_attributes.Max());
-      ess_bdr = 1;
-      fespace->GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
-   }
+   ParFiniteElementSpace *fespace = new ParFiniteElementSpace(pmesh, fec);
 
-   // 6. Define lower and upper bounds for the optimization problem as GridFunctions.
-   //    Both bounds are zero at the boundary of the mesh. Lower bound includes 
-   //    the obstacle function, while the upper bound is "infinity".
-   ConstantCoefficient zero(0.0);
-   FunctionCoefficient obs(RingObstacle);
-   ConstantCoefficient inf(PETSC_INFINITY);
-   
-   GridFunction lb(fespace);
-   lb.ProjectCoefficient(obs);
-   lb.ProjectBdrCoefficient(zero, ess_tdof_list);
-   user.LB = lb;
-   
-   GridFunction ub(fespace);
-   ub.ProjectCoefficient(inf);
-   ub.ProjectBdrCoefficient(zero, ess_tdof_list);
-   user.UB = ub;
-
-   // 7. Define the solution vector u as a finite element grid function
-   //    corresponding to fespace. Also create a work vector here.
-   GridFunction u(fespace);
+   // 8. Define the solution as a finite element grid function. It carries
+   //    the solution of one level to the next when grid sequencing.
+   ParGridFunction u(fespace);
    u = 0.0;
-   user.U = u;
-   GridFunction work(fespace);
-   work = 0.0;
-   user.work = work;
-
-   // 8. Set up the bilinear form a(.,.) on the finite element space
-   //    corresponding to the Laplacian operator Delta, by adding the Diffusion
-   //    domain integrator.
-   ConstantCoefficient one(1.0);
-   BilinearForm *a = new BilinearForm(fespace);
-   a->AddDomainIntegrator(new DiffusionIntegrator(one));
-   a->Assemble();
 
-   // 9. Extract the stiffness matrix from the bilinear form.
-   a->FormSystemMatrix(ess_tdof_list, user.A);
-   user.size = user.A.Height();
-   cout << "Size of linear system: " << user.size << endl;
-   
-   // 10. Initialize PETSc and prepare the PETSc data structures
+   // 9. Initialize PETSc.
    ierr = PetscInitialize( &argc, &argv,(char *)0,help );if (ierr) return ierr;
    
-   ierr = VecCreateSeq(PETSC_COMM_SELF, user.size, &X);CHKERRQ(ierr);
-   ierr = VecSet(X, 1.0);CHKERRQ(ierr);
+   // every rank streams its own part of the iterates
+   ostringstream rank_hist_file;
+   rank_hist_file << hist_file << "." << setfill('0') << setw(6) << myid;
    
-   ierr = VecDuplicate(X, &XL);CHKERRQ(ierr);
-   ierr = VecGetArray(XL, &bounds);
-   for (int i=0; i<user.size; ++i) bounds[i] = user.LB(i);
-   ierr = VecGetArray(XL, &bounds);
-   
-   ierr = VecDuplicate(X, &XU);CHKERRQ(ierr);
-   ierr = VecGetArray(XU, &bounds);
-   for (int i=0; i<user.size; ++i) bounds[i] = user.UB(i);
-   ierr = VecRestoreArray(XU, &bounds);
-   
-   // 11. Create the shell matrix that performs the "matrix-free" 
-   //     Hessian-vector product required by TAO.
-   ierr = MatCreateShell(PETSC_COMM_SELF, user.size, user.size, PETSC_DETERMINE, PETSC_DETERMINE, (void*) &user, &user.H);CHKERRQ(ierr);
-   ierr = MatShellSetOperation(user.H, MATOP_MULT, (void(*)(void))StiffMult);CHKERRQ(ierr);
-   
-   if (visualization) {
-     Vector init_sol(user.work);
-     init_sol = 1.0;
-     user.hist.push_back(init_sol);
+   user.a = NULL;
+   user.hist = NULL;
+   user.hist_stride = hist_stride;
+   user.report_lits = report_lits;
+
+   // 10. In batch mode, assemble the operator, the Hessian shell and the
+   //     PETSc vectors once on the finest mesh and solve for every obstacle
+   //     in the batch file. Each VisIt cycle then holds one obstacle's
+   //     solution.
+   if (obstacles.size())
+   {
+      AssembleProblem(fespace, &user);
+      ierr = CreatePetscObjects(&user, assembled_hpre ? PETSC_TRUE : PETSC_FALSE, &X, &XL, &XU);CHKERRQ(ierr);
+      setup_timer.Stop();
+      if (myid == 0)
+      {
+         cout << "Size of linear system: " << user.A.GetGlobalNumRows() << endl;
+         cout << "Shared setup time: " << setup_timer.RealTime() << " s" << endl;
+      }
+
+      HistoryWriter *sink = NULL;
+      if (visualization) {
+        sink = new HistoryWriter(rank_hist_file.str().c_str(), user.size, hist_encoding, hist_buffer);
+      }
+      ierr = SolveBatch(&user, X, XL, XU, obstacles, warm_start ? PETSC_TRUE : PETSC_FALSE, warm_keep, report_stats ? PETSC_TRUE : PETSC_FALSE, sink);CHKERRQ(ierr);
+      delete sink;
+      ierr = DestroyPetscObjects(&user, &X, &XL, &XU);CHKERRQ(ierr);
    }
-   
-   // 12. Create the TAO optimization algorithm, configure it and start the solution
-   ierr = TaoCreate(PETSC_COMM_WORLD, &tao);CHKERRQ(ierr);
-   ierr = TaoSetType(tao, TAOBNLS);CHKERRQ(ierr);
-   ierr = TaoSetInitialVector(tao, X);CHKERRQ(ierr);
-   ierr = TaoSetObjectiveAndGradientRoutine(tao, FormFunctionGradient, (void*) &user);CHKERRQ(ierr);
-   ierr = TaoSetHessianRoutine(tao, user.H, user.H, FormHessian, (void*) &user);CHKERRQ(ierr);
-   ierr = TaoSetVariableBounds(tao, XL, XU);CHKERRQ(ierr);
-   ierr = TaoSetMonitor(tao, Monitor, &user, NULL);CHKERRQ(ierr);
-   ierr = TaoSetFromOptions(tao);CHKERRQ(ierr);
-   ierr = TaoSolve(tao);CHKERRQ(ierr);
-   
-   // 13. Recover the solution as a finite element grid function.
+   else
+   {
+      // 11. Otherwise, solve the problem for the default ring obstacle on every
+      //     level, coarse to fine. Only the finest level is recorded in the
+      //     iterate history.
+      ObstacleParams ring = { OBS_RING, 0.4, 0.05, 1.0 };
+      for (int level = 0; level < num_levels; level++)
+      {
+         // 11a. Assemble the stiffness matrix and bounds of this level and
+         //      prepare the distributed PETSc data structures.
+         AssembleProblem(fespace, &user);
+         ierr = CreatePetscObjects(&user, assembled_hpre ? PETSC_TRUE : PETSC_FALSE, &X, &XL, &XU);CHKERRQ(ierr);
+         ierr = SetBounds(&user, ring, XL, XU);CHKERRQ(ierr);
+         if (myid == 0)
+         {
+            cout << "Level " << level << ": size of linear system: "
+                 << user.A.GetGlobalNumRows() << endl;
+         }
+
+         // 11b. Warm start from the prolongated coarse solution, projected onto
+         //      the bounds of this level.
+         if (level > 0)
+         {
+            Vector tu(user.size);
+            u.GetTrueDofs(tu);
+            PetscReal *xx;
+            ierr = VecGetArray(X, &xx);CHKERRQ(ierr);
+            for (int i=0; i<user.size; ++i) xx[i] = tu(i);
+            ierr = VecRestoreArray(X, &xx);CHKERRQ(ierr);
+            ierr = VecMedian(XL, X, XU, X);CHKERRQ(ierr);
+         }
+
+         // 11c. Solve with TAO, streaming the iterates on the finest level.
+         bool finest = (level == num_levels - 1);
+         if (visualization && finest) {
+           user.hist = new HistoryWriter(rank_hist_file.str().c_str(), user.size, hist_encoding, hist_buffer);
+         }
+         PetscInt its;
+         ierr = SolveObstacle(&user, TAOBNLS, X, XL, XU, &its);CHKERRQ(ierr);
+         delete user.hist;
+         user.hist = NULL;
+         if (myid == 0)
+         {
+            cout << "Level " << level << ": " << its << " TAO iterations" << endl;
+         }
+         if (report_stats) {
+           ierr = PrintStats(user.stats);CHKERRQ(ierr);
+         }
+
+         // 11d. Keep the solution as a grid function and refine it to the next
+         //      level with the finite element space transfer operator.
+         const PetscReal *xx;
+         ierr = VecGetArrayRead(X, &xx);CHKERRQ(ierr);
+         u.SetFromTrueDofs(Vector(const_cast<PetscReal*>(xx), user.size));
+         ierr = VecRestoreArrayRead(X, &xx);CHKERRQ(ierr);
+         ierr = DestroyPetscObjects(&user, &X, &XL, &XU);CHKERRQ(ierr);
+         if (!finest)
+         {
+            pmesh->UniformRefinement();
+            fespace->Update();
+            u.Update();
+         }
+      }
+   }
+
+   // 12. Recover the solution history from the file as finite element grid
+   //     functions and save one VisIt cycle per stored iterate.
    if (visualization) {
-     GridFunction xc(fespace);
-     VisItDataCollection visit_dc("obstacle", mesh);
-     visit_dc.RegisterField("solution", &xc);
-     int vis_cycle = 0;
-     
-     int hist_len = user.hist.size();
-     for (int i=0; i<hist_len; ++i) {
-       LinearForm *rc = new LinearForm(fespace);
-       rc->AddBoundaryIntegrator(new BoundaryLFIntegrator(zero));
-       rc->Assemble();
-
-       BilinearForm *c = new BilinearForm(fespace);
-       c->AddDomainIntegrator(new DiffusionIntegrator(one));
-       c->Assemble();
-
-       SparseMatrix Cmat;
-       Vector Xvec, Rvec;
-       c->FormLinearSystem(ess_tdof_list, xc, *rc, Cmat, Xvec, Rvec);
-       Xvec = user.hist[i];
-       c->RecoverFEMSolution(Xvec, *rc, xc);
-       
-       visit_dc.SetCycle(vis_cycle++);
-       visit_dc.SetTime(i);
-       visit_dc.Save();
-       
-       delete c;
-       delete rc;
-     }
+     SaveHistory(rank_hist_file.str().c_str(), pmesh, fespace, vis_threads);
    }
    
-   // 14. Clean up PETSc memory
-   ierr = VecDestroy(&X);CHKERRQ(ierr);
-   ierr = VecDestroy(&XU);CHKERRQ(ierr);
-   ierr = VecDestroy(&XL);CHKERRQ(ierr);
-   ierr = MatDestroy(&user.H);CHKERRQ(ierr);
-   ierr = TaoDestroy(&tao);CHKERRQ(ierr);
-   
    ierr = PetscFinalize();
 
-   // 15. Clean up MFEM memory
-   delete a;
+   // 13. Clean up MFEM memory
+   delete user.a;
    delete fespace;
    if (order > 0) { delete fec; }
-   delete mesh;
+   delete pmesh;
+
+   MPI_Finalize();
 
    return 0;
 }